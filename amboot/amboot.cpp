@@ -1,9 +1,22 @@
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <type_traits>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 using namespace std;
 
@@ -15,6 +28,17 @@ constexpr unsigned int BUFFER_SIZE = 1024 * 1024; // 1 Mibi byte
 constexpr unsigned int SECTORS_PER_GiB = 1024 * 1024 * 1024 / SECTOR_SIZE;
 constexpr uint8_t MAGIC_XBR = 0x42;
 constexpr uint16_t MAGIC_MBR = (uint16_t)0xAA55;
+constexpr uint64_t MAX_MBR_LBA = 0xFFFFFFFFull; // MBR addresses up to 2 TiB only
+constexpr char MAGIC_V2[8] = {'A', 'M', 'B', 'O', 'O', 'T', 'V', '2'};
+constexpr uint32_t HEADER_VERSION = 2;
+constexpr uint64_t GPT_ENTRIES_COUNT = 128;
+constexpr uint64_t GPT_ENTRIES_SECTORS = GPT_ENTRIES_COUNT * 128 / SECTOR_SIZE;
+constexpr uint64_t HEADER_V2_LBA = 2 + GPT_ENTRIES_SECTORS; // right after room for primary GPT
+constexpr uint64_t HEADER_V2_ALIGN = 2048;  // v2 header region is rounded up to 1 MiB
+constexpr uint32_t FLAG_GPT = 1;            // v2 header: host side GPT is written
+constexpr size_t MAX_IMAGECOUNT_V2 = 65536;
+constexpr char MAGIC_MANIFEST[8] = {'A', 'M', 'B', 'M', 'A', 'N', 'I', '1'};
+constexpr unsigned SCRUB_SAMPLES = 16; // blocks per image re-read by scrub by default
 
 #pragma pack(push, 1)
 //{
@@ -57,12 +81,75 @@ struct ImageInfo
     char imageName[SECTOR_SIZE - 4 * sizeof(uint32_t)];
 };
 constexpr size_t MAX_IMAGECOUNT = (HEADER_SIZE - sizeof(ExtBootRecord) - sizeof(ExtBootRecord)) / sizeof(ImageInfo);
-struct DiskHeader
+struct DiskHeader // Layout v1: fixed HEADER_SIZE, 32-bit LBAs
 {
     MasterBootRecord mbr;
     ExtBootRecord xbr;
     ImageInfo images[MAX_IMAGECOUNT];
 };
+struct ImageInfoV2
+{
+    uint64_t firstSectorLBA;
+    uint64_t sectorsCountLBA;
+    uint64_t part0firstSectorLBA;
+    uint64_t reserved_;
+    char imageName[128 - 4 * sizeof(uint64_t)];
+};
+struct HeaderV2 // Layout v2: at HEADER_V2_LBA, image table follows it, first image at headerSectors
+{
+    char magic[sizeof(MAGIC_V2)];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t imagesCount;
+    uint64_t tableLBA;
+    uint64_t headerSectors;
+    uint32_t tableCrc;
+    uint32_t headerCrc; // crc of this sector with headerCrc zeroed
+    char reserved[SECTOR_SIZE - sizeof(MAGIC_V2) - 2 * sizeof(uint32_t) - 3 * sizeof(uint64_t) - 2 * sizeof(uint32_t)];
+};
+struct ManifestHeader // Block hash manifest: in first sector after last image slot
+{
+    char magic[sizeof(MAGIC_MANIFEST)];
+    uint32_t blockSize;
+    uint32_t entriesCrc;
+    uint64_t imagesCount;
+    uint32_t headerCrc; // crc of this sector with headerCrc zeroed
+    char reserved[SECTOR_SIZE - sizeof(MAGIC_MANIFEST) - 2 * sizeof(uint32_t) - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+struct ManifestEntry // one per image, follow ManifestHeader
+{
+    uint64_t sourceBytes;
+    uint64_t blocksCount;
+    uint64_t hashesLBA; // blocksCount of xxh64 hashes of blockSize blocks as written to device
+    uint64_t digest;    // xxh64 of block hashes, identifies whole image
+};
+struct GptHeader
+{
+    char signature[8];
+    uint32_t revision;
+    uint32_t headerSize;
+    uint32_t headerCrc;
+    uint32_t reserved;
+    uint64_t currentLBA;
+    uint64_t backupLBA;
+    uint64_t firstUsableLBA;
+    uint64_t lastUsableLBA;
+    uint8_t diskGuid[16];
+    uint64_t entriesLBA;
+    uint32_t entriesCount;
+    uint32_t entrySize;
+    uint32_t entriesCrc;
+    char pad[SECTOR_SIZE - 92];
+};
+struct GptEntry
+{
+    uint8_t typeGuid[16];
+    uint8_t uniqueGuid[16];
+    uint64_t firstLBA;
+    uint64_t lastLBA;
+    uint64_t attributes;
+    uint16_t name[36];
+};
 // check sizes and alignments at compile time:
 inline void check_struct()
 {
@@ -76,11 +163,134 @@ inline void check_struct()
         break;
     case ((sizeof(DiskHeader) == HEADER_SIZE) * 3):
         break;
+    case ((sizeof(HeaderV2) == SECTOR_SIZE) * 4):
+        break;
+    case ((SECTOR_SIZE % sizeof(ImageInfoV2) == 0) * 5):
+        break;
+    case ((sizeof(GptHeader) == SECTOR_SIZE) * 6):
+        break;
+    case ((sizeof(GptEntry) == 128) * 7):
+        break;
+    case ((sizeof(ManifestHeader) == SECTOR_SIZE) * 8):
+        break;
+    case ((SECTOR_SIZE % sizeof(ManifestEntry) == 0) * 9):
+        break;
     }
 }
 //}
 #pragma pack(pop)
 
+// In-memory image slot, the same for both header layouts
+struct ImageSlot
+{
+    uint64_t firstSectorLBA;
+    uint64_t sectorsCountLBA;
+    uint64_t part0firstSectorLBA;
+    string imageName;
+    uint64_t sourceBytes;          // from manifest, 0 if unknown
+    vector<uint64_t> blockHashes;  // from manifest, per BUFFER_SIZE block
+};
+
+struct Crc32Table
+{
+    uint32_t value[256];
+    Crc32Table()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            value[i] = c;
+        }
+    }
+};
+uint32_t crc32(const void *data, size_t size)
+{
+    static const Crc32Table table;
+    uint32_t crc = 0xFFFFFFFF;
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table.value[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+// XXH64 from https://github.com/Cyan4973/xxHash, enough for per-block hashes
+// and no dependency to build on TV-box
+constexpr uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t XXH_PRIME2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t XXH_PRIME3 = 0x165667B19E3779F9ull;
+constexpr uint64_t XXH_PRIME4 = 0x85EBCA77C2B2AE63ull;
+constexpr uint64_t XXH_PRIME5 = 0x27D4EB2F165667C5ull;
+
+inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+inline uint64_t xxhMerge(uint64_t acc, uint64_t val)
+{
+    return (acc ^ xxhRound(0, val)) * XXH_PRIME1 + XXH_PRIME4;
+}
+uint64_t xxh64(const void *data, size_t size, uint64_t seed = 0)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + size;
+    uint64_t h;
+    uint64_t lane;
+    uint32_t half;
+    if (size >= 32)
+    {
+        uint64_t v[4] = {seed + XXH_PRIME1 + XXH_PRIME2, seed + XXH_PRIME2, seed, seed - XXH_PRIME1};
+        for (; p + 32 <= end; p += 32)
+        {
+            for (int k = 0; k < 4; k++)
+            {
+                memcpy(&lane, p + 8 * k, sizeof(lane));
+                v[k] = xxhRound(v[k], lane);
+            }
+        }
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int k = 0; k < 4; k++)
+        {
+            h = xxhMerge(h, v[k]);
+        }
+    }
+    else
+    {
+        h = seed + XXH_PRIME5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8)
+    {
+        memcpy(&lane, p, sizeof(lane));
+        h = rotl64(h ^ xxhRound(0, lane), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        memcpy(&half, p, sizeof(half));
+        h = rotl64(h ^ (half * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
 void fillImageName(char *dst, const char *src, size_t size)
 {
     const char *lastPos = strrchr(src, '/');
@@ -121,94 +331,594 @@ namespace err
         emptyList,  // Error: no image files defined in list file
         imageToBig, // Image file doesn't fit in requested size
         increase,   // Error: increase size for partition # name
-        imageCount, // Error: MAX_IMAGECOUNT exceeded      
+        imageCount, // Error: MAX_IMAGECOUNT_V2 or GPT entries count exceeded
         noActive,   // Error: no active partition selected.
         noMagic,    // ExtBootRecord xbr contains no expected magic
         emptyBoot,  // Error: No images found on device
         mbrMagic,   // Error: no magic in mbr of image
         imageNum,   // Error: image number is greater then count of images
-        space       // Not enough space on dst device
+        space,      // Not enough space on dst device
+        noImage,    // Error: image name not found on device
+        lbaRange,   // Error: image lies beyond 2 TiB, MBR cannot boot it
+        badHeader,  // Error: v2 header or image table is corrupted
+        srcRead,    // Error reading one of src images
+        noManifest, // Error: no valid block hash manifest on device
+        mismatch    // Source image or device blocks differ from manifest
     };
 };
 
+// I/O backends. ImageKeeper and ImageReader take backend as template parameter,
+// so hot copy loop calls it directly, without virtual dispatch.
+// Device interface: open, isOpen, close, getSize, seek, read, write, sync.
+// Source interface: open, read returning count of bytes, 0 on end of file, -1 on error.
+constexpr size_t IO_ALIGN = 4096; // buffer alignment, enough for O_DIRECT on any sector size
+
+struct FreeDeleter
+{
+    void operator()(char *p) const
+    {
+        free(p);
+    }
+};
+typedef unique_ptr<char, FreeDeleter> AlignedBuffer;
+
+AlignedBuffer allocAligned(size_t size)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, IO_ALIGN, size) != 0)
+    {
+        throw bad_alloc();
+    }
+    return AlignedBuffer((char *)p);
+}
+
+class FstreamSource
+{
+public:
+    bool open(const char *fileName)
+    {
+        image.open(fileName, ios::in | ios::binary);
+        return !(image.eof() || image.bad() || !image.is_open());
+    }
+    void close()
+    {
+        image.close();
+    }
+    streamsize read(char *buffer, size_t size)
+    {
+        image.read(buffer, size);
+        if (image.bad())
+        {
+            return -1;
+        }
+        return image.gcount();
+    }
+private:
+    ifstream image;
+};
+
+class FstreamIo
+{
+public:
+    typedef FstreamSource Source;
+    bool open(const char *deviceName, bool readOnly)
+    {
+        name = deviceName;
+        device.open(deviceName, (readOnly ? ios::in : (ios::out | ios::in)) | ios::binary);
+        return !(device.eof() || device.bad() || !device.is_open());
+    }
+    void close()
+    {
+        device.close();
+    }
+    bool getSize(uint64_t &size)
+    {
+        streampos position = device.tellp();
+        device.seekp(0, ios::end);
+        size = uint64_t(streamoff(device.tellp()));
+        device.seekp(position);
+        return !device.fail();
+    }
+    bool seek(streamoff offset, ios_base::seekdir dir)
+    {
+        device.seekp(offset, dir);
+        return !device.fail();
+    }
+    bool read(char *buffer, size_t size)
+    {
+        device.read(buffer, size);
+        return !device.fail();
+    }
+    bool write(const char *buffer, size_t size)
+    {
+        device.write(buffer, size);
+        return !device.fail();
+    }
+    bool sync()
+    {
+        device.flush();
+        if (device.fail())
+        {
+            return false;
+        }
+        // fstream has no fsync, so flush device cache through a separate descriptor
+        int fd = ::open(name.c_str(), O_RDONLY);
+        bool synced = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return synced;
+    }
+private:
+    string name;
+    fstream device;
+};
+
+template <bool Direct>
+class PosixSourceT
+{
+public:
+    PosixSourceT(): fd(-1)
+    {
+    }
+    ~PosixSourceT()
+    {
+        close();
+    }
+    bool open(const char *fileName)
+    {
+        fd = ::open(fileName, O_RDONLY | (Direct ? O_DIRECT : 0));
+        if (fd < 0)
+        {
+            return false;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return true;
+    }
+    void close()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    // Reads whole buffer unless end of file is reached.
+    // With O_DIRECT buffer and size must be IO_ALIGN aligned, as ImageKeeper copy buffer is.
+    streamsize read(char *buffer, size_t size)
+    {
+        size_t total = 0;
+        while (total < size)
+        {
+            ssize_t count = ::read(fd, buffer + total, size - total);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count < 0)
+            {
+                return -1;
+            }
+            if (count == 0)
+            {
+                break;
+            }
+            total += count;
+        }
+        return total;
+    }
+private:
+    int fd;
+};
+
+// pread/pwrite on single descriptor, Direct adds O_DIRECT to bypass page cache
+template <bool Direct>
+class PosixIoT
+{
+public:
+    typedef PosixSourceT<Direct> Source;
+    PosixIoT(): fd(-1), position(0), size(0)
+    {
+    }
+    ~PosixIoT()
+    {
+        close();
+    }
+    bool open(const char *deviceName, bool readOnly)
+    {
+        fd = ::open(deviceName, (readOnly ? O_RDONLY : O_RDWR) | (Direct ? O_DIRECT : 0));
+        if (fd < 0)
+        {
+            return false;
+        }
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end < 0)
+        {
+            return false;
+        }
+        size = end;
+        return true;
+    }
+    void close()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    bool getSize(uint64_t &size_)
+    {
+        size_ = size;
+        return true;
+    }
+    bool seek(streamoff offset, ios_base::seekdir dir)
+    {
+        streamoff base = dir == ios::beg ? 0 : dir == ios::end ? streamoff(size) : streamoff(position);
+        if (base + offset < 0)
+        {
+            return false;
+        }
+        position = base + offset;
+        return true;
+    }
+    bool read(char *buffer, size_t count)
+    {
+        if (!isAligned(buffer, count))
+        {
+            return bounce(buffer, count, false);
+        }
+        if (!transfer(buffer, count, position, false))
+        {
+            return false;
+        }
+        position += count;
+        return true;
+    }
+    bool write(const char *buffer, size_t count)
+    {
+        if (!isAligned(buffer, count))
+        {
+            return bounce((char *)buffer, count, true);
+        }
+        if (!transfer((char *)buffer, count, position, true))
+        {
+            return false;
+        }
+        position += count;
+        return true;
+    }
+    bool sync()
+    {
+        return fsync(fd) == 0;
+    }
+private:
+    bool isAligned(const char *buffer, size_t count) const
+    {
+        return !Direct || ((uintptr_t(buffer) | count | position) & (SECTOR_SIZE - 1)) == 0;
+    }
+    bool transfer(char *buffer, size_t count, uint64_t offset, bool isWrite)
+    {
+        while (count)
+        {
+            ssize_t done = isWrite ? pwrite(fd, buffer, count, offset) : pread(fd, buffer, count, offset);
+            if (done < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (done <= 0)
+            {
+                return false;
+            }
+            buffer += done;
+            count -= done;
+            offset += done;
+        }
+        return true;
+    }
+    // O_DIRECT with unaligned buffer, size or position: go through aligned copy,
+    // reading partial sectors first on write
+    bool bounce(char *buffer, size_t count, bool isWrite)
+    {
+        uint64_t start = position & ~uint64_t(SECTOR_SIZE - 1);
+        uint64_t end = (position + count + SECTOR_SIZE - 1) & ~uint64_t(SECTOR_SIZE - 1);
+        AlignedBuffer aligned = allocAligned(end - start);
+        if ((!isWrite || start != position || end != position + count) &&
+            !transfer(aligned.get(), end - start, start, false))
+        {
+            return false;
+        }
+        if (isWrite)
+        {
+            memcpy(aligned.get() + (position - start), buffer, count);
+            if (!transfer(aligned.get(), end - start, start, true))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            memcpy(buffer, aligned.get() + (position - start), count);
+        }
+        position += count;
+        return true;
+    }
+    int fd;
+    uint64_t position;
+    uint64_t size;
+};
+typedef PosixIoT<false> PosixIo;
+typedef PosixIoT<true> DirectIo;
+
+// RAM disk for benchmarks and tests. Device name is mem:<size in GiB>, devices with
+// the same name share storage within process. Storage is sparse: chunks are allocated
+// on first non-zero write.
+class MemoryIo
+{
+public:
+    typedef PosixSourceT<false> Source;
+    MemoryIo(): position(0)
+    {
+    }
+    bool open(const char *deviceName, bool readOnly)
+    {
+        (void)readOnly;
+        disk = lookup(deviceName);
+        return disk.get() != NULL;
+    }
+    void close()
+    {
+        disk.reset();
+    }
+    bool getSize(uint64_t &size)
+    {
+        size = disk->size;
+        return true;
+    }
+    bool seek(streamoff offset, ios_base::seekdir dir)
+    {
+        streamoff base = dir == ios::beg ? 0 : dir == ios::end ? streamoff(disk->size) : streamoff(position);
+        if (base + offset < 0)
+        {
+            return false;
+        }
+        position = base + offset;
+        return true;
+    }
+    bool read(char *buffer, size_t count)
+    {
+        if (position + count > disk->size)
+        {
+            return false;
+        }
+        while (count)
+        {
+            size_t offset = position % BUFFER_SIZE;
+            size_t part = min(count, BUFFER_SIZE - offset);
+            auto found = disk->chunks.find(position / BUFFER_SIZE);
+            if (found == disk->chunks.end())
+            {
+                memset(buffer, 0, part);
+            }
+            else
+            {
+                memcpy(buffer, found->second.get() + offset, part);
+            }
+            buffer += part;
+            count -= part;
+            position += part;
+        }
+        return true;
+    }
+    bool write(const char *buffer, size_t count)
+    {
+        if (position + count > disk->size)
+        {
+            return false;
+        }
+        while (count)
+        {
+            size_t offset = position % BUFFER_SIZE;
+            size_t part = min(count, BUFFER_SIZE - offset);
+            auto found = disk->chunks.find(position / BUFFER_SIZE);
+            if (found != disk->chunks.end())
+            {
+                memcpy(found->second.get() + offset, buffer, part);
+            }
+            else if (!isZero(buffer, part))
+            {
+                unique_ptr<char[]> &chunk = disk->chunks[position / BUFFER_SIZE];
+                chunk.reset(new char[BUFFER_SIZE]());
+                memcpy(chunk.get() + offset, buffer, part);
+            }
+            buffer += part;
+            count -= part;
+            position += part;
+        }
+        return true;
+    }
+    bool sync()
+    {
+        return true;
+    }
+private:
+    struct Disk
+    {
+        uint64_t size;
+        unordered_map<uint64_t, unique_ptr<char[]>> chunks;
+    };
+    static bool isZero(const char *buffer, size_t count)
+    {
+        return count == 0 || (buffer[0] == 0 && memcmp(buffer, buffer + 1, count - 1) == 0);
+    }
+    static shared_ptr<Disk> lookup(const char *deviceName)
+    {
+        static mutex lock;
+        static unordered_map<string, shared_ptr<Disk>> disks;
+        if (strncmp(deviceName, "mem:", 4) != 0)
+        {
+            return shared_ptr<Disk>();
+        }
+        char *endptr;
+        unsigned long long sizeGiB = strtoull(deviceName + 4, &endptr, 10);
+        if (sizeGiB < 1 || *endptr != 0)
+        {
+            return shared_ptr<Disk>();
+        }
+        lock_guard<mutex> guard(lock);
+        shared_ptr<Disk> &disk = disks[deviceName];
+        if (!disk)
+        {
+            disk.reset(new Disk());
+            disk->size = sizeGiB << BYTES_TO_GIB;
+        }
+        return disk;
+    }
+    shared_ptr<Disk> disk;
+    uint64_t position;
+};
+
+template <class Io>
 class ImageKeeper
 {
 public:
-    ImageKeeper(const char *deviceName, bool preview_);
+    ImageKeeper(const char *deviceName, bool preview_, ostream &errorLog_ = cerr);
     err::status error() const
     {
         return statusError;
     }
-    err::status write(istream &image, const string &imageName, int imageSizeGiB);
-    err::status saveBoot(unsigned bootNumber);
+    err::status setLayout(size_t imagesCount, uint64_t requiredGiB, bool gpt_);
+    err::status write(typename Io::Source &image, const string &imageName, unsigned imageSizeGiB);
+    err::status saveBoot(unsigned bootNumber, bool mbrOnly = false);
     err::status readBoot();
+    err::status readManifest();
     err::status print();
-    streampos getSize() const
+    err::status compare(typename Io::Source &image, unsigned bootNumber);
+    err::status scrub(unsigned samples);
+    unsigned findImage(const char *imageName) const;
+    size_t getImagesCount() const
+    {
+        return images.size();
+    }
+    const char *getImageName(unsigned bootNumber) const
+    {
+        return images[bootNumber - 1].imageName.c_str();
+    }
+    uint64_t getSize() const
     {
         return size;
     }
+    uint64_t getHeaderSize() const
+    {
+        return headerSectors << BYTES_TO_SECTORS;
+    }
+    uint64_t getReservedSize() const // header, manifest and backup GPT at the end of device
+    {
+        return getHeaderSize() + (manifestSectors << BYTES_TO_SECTORS) + (gpt ? (GPT_ENTRIES_SECTORS + 1) << BYTES_TO_SECTORS : 0);
+    }
 private:
-    void write(const char *buffer, streamsize size)
+    void write(const char *buffer, size_t size)
     {
         if (preview)
         {
             return;
         }
-        device.write(buffer, size);
-        if (device.fail())
+        if (!device.write(buffer, size))
         {
             statusError = err::dstFail;
-            cerr << "Error: fail wrining image to " << name << "." << endl;
+            errorLog << "Error: fail wrining image to " << name << "." << endl;
         }
     }
-    void read(char *buffer, streamsize size)
+    void read(char *buffer, size_t size)
     {
-        device.read(buffer, size);
-        if (device.fail())
+        if (!device.read(buffer, size))
         {
-            cerr << "Error reading dst device " << name << endl;
+            errorLog << "Error reading dst device " << name << endl;
             statusError = err::dstRead;
         }
     }
-    void seek(ios::streamoff offset, ios_base::seekdir dir)
+    void seek(streamoff offset, ios_base::seekdir dir)
     {
-        device.seekp(offset, dir);
-        if (device.fail())
+        if (!device.seek(offset, dir))
         {
-            cerr << "Error seeking dst device " << name << endl;
+            errorLog << "Error seeking dst device " << name << endl;
             statusError = err::dstSeek;
         }
     }
+    void sync()
+    {
+        if (!device.sync())
+        {
+            errorLog << "Error flushing dst device " << name << endl;
+            statusError = err::dstFlush;
+        }
+    }
+    size_t nameSize() const
+    {
+        return version == 1 ? sizeof(ImageInfo::imageName) : sizeof(ImageInfoV2::imageName);
+    }
+    uint64_t chainEnd() const
+    {
+        return images.back().firstSectorLBA + images.back().sectorsCountLBA;
+    }
+    void indexNames();
+    static bool mbrFits(const MasterBootRecord &imageMbr, uint64_t imageSizeBytes)
+    {
+        return uint64_t(imageMbr.partition[1].firstSectorLBA) + imageMbr.partition[1].sectorsCountLBA <= (imageSizeBytes >> BYTES_TO_SECTORS);
+    }
+    err::status fitMbr(MasterBootRecord &imageMbr, uint64_t imageSizeBytes, const string &imageName, unsigned number);
+    void fillManifest(vector<char> &manifest) const;
+    void fillHeaderV1(vector<char> &header) const;
+    void fillHeaderV2(vector<char> &header) const;
+    void fillGpt(vector<char> &entries, GptHeader &gptHeader, bool backup) const;
+    err::status readHeaderV1(const vector<char> &header);
+    err::status readHeaderV2(const vector<char> &header);
     err::status statusError;
-    unsigned imagesCount;
     bool preview;
-    streampos size; // size of device in bytes
+    bool gpt;
+    unsigned version;       // header layout version, 1 or 2
+    uint64_t headerSectors; // first image starts right after header
+    uint64_t manifestSectors; // room reserved for manifest after last image
+    uint64_t guidSeed; // GPT GUIDs of this build, same for primary and backup table
+    uint64_t size; // size of device in bytes
     string name;
-    fstream device;
-    DiskHeader hdr;
+    ostream &errorLog; // batch switch collects messages per device
+    Io device;
+    MasterBootRecord mbr;
+    vector<ImageSlot> images;
+    unordered_map<string, unsigned> nameIndex; // short image name to boot number
 };
-ImageKeeper::ImageKeeper(const char *deviceName, bool preview_):
+template <class Io>
+ImageKeeper<Io>::ImageKeeper(const char *deviceName, bool preview_, ostream &errorLog_):
     statusError(err::ok),
-    imagesCount(0),
     preview(preview_),
+    gpt(false),
+    version(1),
+    headerSectors(HEADER_SIZE >> BYTES_TO_SECTORS),
+    manifestSectors(0),
+    guidSeed(0),
     size(0),
     name(deviceName),
-    device(deviceName, (preview_ ? ios::in : (ios::out | ios::in)) | ios::binary)
+    errorLog(errorLog_)
 {
-    memset(&hdr, 0, sizeof(hdr));
-    if (device.eof() || device.bad() || !device.is_open())
+    memset(&mbr, 0, sizeof(mbr));
+    if (!device.open(deviceName, preview_))
     {
-        cerr << "Error opening dst device " << name << endl;
+        errorLog << "Error opening dst device " << name << endl;
         statusError = err::dstOpen;
     }
     else
     {
-        seek(0, ios::end);
+        if (!device.getSize(size))
+        {
+            errorLog << "Error seeking dst device " << name << endl;
+            statusError = err::dstSeek;
+        }
         if (statusError)
         {
             return;
         }
-        size = device.tellp();
         seek(HEADER_SIZE, ios::beg);
         if (statusError)
         {
@@ -220,15 +930,73 @@ ImageKeeper::ImageKeeper(const char *deviceName, bool preview_):
         device.close();
     }
 }
-err::status ImageKeeper::write(istream &image, const string &imageName, int imageSizeGiB)
+template <class Io>
+err::status ImageKeeper<Io>::setLayout(size_t imagesCount, uint64_t requiredGiB, bool gpt_)
+{
+    gpt = gpt_;
+    // header and entries, then hashes of each image rounded up to sector
+    manifestSectors = 1 + (imagesCount * sizeof(ManifestEntry) + SECTOR_SIZE - 1) / SECTOR_SIZE +
+                      (requiredGiB << BYTES_TO_GIB) / BUFFER_SIZE * sizeof(uint64_t) / SECTOR_SIZE + imagesCount;
+    uint64_t v1End = (HEADER_SIZE >> BYTES_TO_SECTORS) + (requiredGiB << (BYTES_TO_GIB - BYTES_TO_SECTORS));
+    if (!gpt && imagesCount <= MAX_IMAGECOUNT && v1End <= MAX_MBR_LBA)
+    {
+        // Keep old layout while it fits, so chains stay readable by older amboot
+        version = 1;
+        headerSectors = HEADER_SIZE >> BYTES_TO_SECTORS;
+    }
+    else
+    {
+        if (gpt && imagesCount > GPT_ENTRIES_COUNT)
+        {
+            errorLog << "Error: image count is " << imagesCount << ". GPT limit is " << GPT_ENTRIES_COUNT << endl;
+            return (statusError = err::imageCount);
+        }
+        if (gpt)
+        {
+            // Unique per build, so drives built from one list can share a host
+            random_device entropy;
+            guidSeed = (uint64_t(entropy()) << 32) ^ entropy();
+        }
+        version = HEADER_VERSION;
+        uint64_t tableSectors = (imagesCount * sizeof(ImageInfoV2) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        headerSectors = (HEADER_V2_LBA + 1 + tableSectors + HEADER_V2_ALIGN - 1) / HEADER_V2_ALIGN * HEADER_V2_ALIGN;
+    }
+    seek(getHeaderSize(), ios::beg);
+    return statusError;
+}
+// Stretch second (root) partition of image to the end of its slot
+template <class Io>
+err::status ImageKeeper<Io>::fitMbr(MasterBootRecord &imageMbr, uint64_t imageSizeBytes, const string &imageName, unsigned number)
 {
-    unique_ptr<char> buffer(new char[BUFFER_SIZE]);
-    streamsize imageSizeBytes = streamsize(imageSizeGiB) << BYTES_TO_GIB; // Size in bytes of current image/partition
-    streamsize totalCount = 0;
+    if (!mbrFits(imageMbr, imageSizeBytes))
+    {
+        uint64_t requiredGiB = (uint64_t(imageMbr.partition[1].sectorsCountLBA) + imageMbr.partition[1].firstSectorLBA - 1 + SECTORS_PER_GiB) / SECTORS_PER_GiB;
+        errorLog << "Error: size of image " << imageName << " #" << number << " requires at least " << requiredGiB << "GiB" << endl;
+        return (statusError = err::increase);
+    }
+    uint64_t newSectorsCountLBA = (imageSizeBytes >> BYTES_TO_SECTORS) - imageMbr.partition[1].firstSectorLBA;
+    if (newSectorsCountLBA > MAX_MBR_LBA - imageMbr.partition[1].firstSectorLBA)
+    {
+        newSectorsCountLBA = MAX_MBR_LBA - imageMbr.partition[1].firstSectorLBA;
+    }
+    imageMbr.partition[1].sectorsCountLBA = (uint32_t)newSectorsCountLBA;
+    return statusError;
+}
+template <class Io>
+err::status ImageKeeper<Io>::write(typename Io::Source &image, const string &imageName, unsigned imageSizeGiB)
+{
+    AlignedBuffer buffer = allocAligned(BUFFER_SIZE);
+    uint64_t imageSizeBytes = uint64_t(imageSizeGiB) << BYTES_TO_GIB; // Size in bytes of current image/partition
+    uint64_t totalCount = 0;
 
-    hdr.images[imagesCount].firstSectorLBA = imagesCount ? hdr.images[imagesCount-1].firstSectorLBA + hdr.images[imagesCount-1].sectorsCountLBA : HEADER_SIZE >> BYTES_TO_SECTORS;
-    hdr.images[imagesCount].sectorsCountLBA = imageSizeGiB << (BYTES_TO_GIB - BYTES_TO_SECTORS);
-    fillImageName(hdr.images[imagesCount].imageName, imageName.c_str(), sizeof(hdr.images[imagesCount].imageName));
+    ImageSlot slot;
+    slot.firstSectorLBA = images.empty() ? headerSectors : chainEnd();
+    slot.sectorsCountLBA = imageSizeBytes >> BYTES_TO_SECTORS;
+    slot.part0firstSectorLBA = 0;
+    slot.sourceBytes = 0;
+    vector<char> shortName(nameSize());
+    fillImageName(shortName.data(), imageName.c_str(), shortName.size());
+    slot.imageName = shortName.data();
 
     bool mbrCalculated = false;
 
@@ -236,32 +1004,36 @@ err::status ImageKeeper::write(istream &image, const string &imageName, int imag
 
     cout << "Info: writing " << imageName << endl << imageSizeBytes << " bytes total." << endl;
 
-    while (image.read(buffer.get(), BUFFER_SIZE))
+    streamsize countRead;
+    while ((countRead = image.read(buffer.get(), BUFFER_SIZE)) > 0)
     {
-        streamsize countRead = image.gcount();
+        slot.sourceBytes += countRead;
+        if (countRead < BUFFER_SIZE)
+        {
+            // Zero tail of last block: device writes stay sector aligned
+            // and block hash matches whole block as it is on device
+            memset(buffer.get() + countRead, 0, BUFFER_SIZE - countRead);
+            countRead = (countRead + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        }
 
         if (!mbrCalculated)
         {
             MasterBootRecord &mbr = *(MasterBootRecord *)buffer.get();
-            auto newSectorsCountLBA = (imageSizeBytes >> BYTES_TO_SECTORS) - mbr.partition[1].firstSectorLBA;
-            if (mbr.partition[1].sectorsCountLBA > newSectorsCountLBA)
+            if (fitMbr(mbr, imageSizeBytes, imageName, images.size() + 1))
             {
-                int requiredGiB = (mbr.partition[1].sectorsCountLBA + mbr.partition[1].firstSectorLBA - 1 + SECTORS_PER_GiB) / SECTORS_PER_GiB;
-                cerr << "Error: size of image " << imageName << " #" << imagesCount+1 << " requires at least " << requiredGiB << "GiB" << endl;
-                statusError = err::increase;
                 return statusError;
             }
-            hdr.images[imagesCount].part0firstSectorLBA = mbr.partition[0].firstSectorLBA;
-            mbr.partition[1].sectorsCountLBA = (uint32_t)newSectorsCountLBA;
+            slot.part0firstSectorLBA = mbr.partition[0].firstSectorLBA;
             mbrCalculated = true;
         }
+        slot.blockHashes.push_back(xxh64(buffer.get(), BUFFER_SIZE));
 
         totalCount += countRead;
 
         if (totalCount > imageSizeBytes)
         {
             statusError = err::imageToBig;
-            cerr << "Error: size of image " << imageName << " is greater than requested size " << imageSizeGiB << " GiB." << endl;
+            errorLog << "Error: size of image " << imageName << " is greater than requested size " << imageSizeGiB << " GiB." << endl;
             return statusError;
         }
 
@@ -281,6 +1053,11 @@ err::status ImageKeeper::write(istream &image, const string &imageName, int imag
             break;
         }
     }
+    if (countRead < 0)
+    {
+        errorLog << "Error reading src image " << imageName << endl;
+        return (statusError = err::srcRead);
+    }
 
     memset(buffer.get(), 0, BUFFER_SIZE);
     while (totalCount < imageSizeBytes - BUFFER_SIZE)
@@ -308,23 +1085,24 @@ err::status ImageKeeper::write(istream &image, const string &imageName, int imag
         cout.flush();
     }
 
-    imagesCount++; // increment count only if success
+    images.push_back(slot); // add image only if success
     return statusError;
 }
-err::status ImageKeeper::print()
+template <class Io>
+err::status ImageKeeper<Io>::print()
 {
     int activeNumber = 0;
-    for (unsigned i = 0; i < imagesCount; i++)
+    for (unsigned i = 0; i < images.size(); i++)
     {
         char isActive = ' ';
-        if (hdr.mbr.partition[0].firstSectorLBA == hdr.images[i].firstSectorLBA + hdr.images[i].part0firstSectorLBA)
+        if (mbr.partition[0].firstSectorLBA == images[i].firstSectorLBA + images[i].part0firstSectorLBA)
         {
             isActive = '*';
             activeNumber = i + 1;
         }
-        cout << isActive << ' ' << i+1 << ": " << hdr.images[i].imageName << endl;
+        cout << isActive << ' ' << i+1 << ": " << images[i].imageName << endl;
     }
-    if (hdr.mbr.partition[0].firstSectorLBA == 0 && hdr.mbr.mbr_signature == 0) // MBR is zeroed
+    if (mbr.partition[0].firstSectorLBA == 0 && mbr.mbr_signature == 0) // MBR is zeroed
     {
         cout << "MBR is zeroed" << endl;
     }
@@ -335,105 +1113,601 @@ err::status ImageKeeper::print()
     else
     {
         cout << "First MBR partition points outside." << endl;
-        cerr << "Error: no active partition selected in MBR." << endl;
+        errorLog << "Error: no active partition selected in MBR." << endl;
         statusError = err::noActive;
     }
+    cout << "Header v" << version << (gpt ? " with GPT, host only, does not boot" : "") << endl;
+    return statusError;
+}
+template <class Io>
+void ImageKeeper<Io>::indexNames()
+{
+    nameIndex.clear();
+    for (unsigned i = 0; i < images.size(); i++)
+    {
+        nameIndex.insert(make_pair(images[i].imageName, i + 1)); // first image wins on duplicate names
+    }
+}
+template <class Io>
+void ImageKeeper<Io>::fillHeaderV1(vector<char> &header) const
+{
+    DiskHeader &hdr = *(DiskHeader *)header.data();
+    hdr.mbr = mbr;
+    memset(&hdr.xbr, MAGIC_XBR, sizeof(hdr.xbr));
+    for (unsigned i = 0; i < images.size(); i++)
+    {
+        hdr.images[i].firstSectorLBA = (uint32_t)images[i].firstSectorLBA;
+        hdr.images[i].sectorsCountLBA = (uint32_t)images[i].sectorsCountLBA;
+        hdr.images[i].part0firstSectorLBA = (uint32_t)images[i].part0firstSectorLBA;
+        fillImageName(hdr.images[i].imageName, images[i].imageName.c_str(), sizeof(hdr.images[i].imageName));
+    }
+}
+template <class Io>
+void ImageKeeper<Io>::fillHeaderV2(vector<char> &header) const
+{
+    *(MasterBootRecord *)header.data() = mbr;
+    HeaderV2 &hdr = *(HeaderV2 *)&header[HEADER_V2_LBA << BYTES_TO_SECTORS];
+    ImageInfoV2 *table = (ImageInfoV2 *)&header[(HEADER_V2_LBA + 1) << BYTES_TO_SECTORS];
+    for (unsigned i = 0; i < images.size(); i++)
+    {
+        table[i].firstSectorLBA = images[i].firstSectorLBA;
+        table[i].sectorsCountLBA = images[i].sectorsCountLBA;
+        table[i].part0firstSectorLBA = images[i].part0firstSectorLBA;
+        fillImageName(table[i].imageName, images[i].imageName.c_str(), sizeof(table[i].imageName));
+    }
+    memcpy(hdr.magic, MAGIC_V2, sizeof(hdr.magic));
+    hdr.version = HEADER_VERSION;
+    hdr.flags = gpt ? FLAG_GPT : 0;
+    hdr.imagesCount = images.size();
+    hdr.tableLBA = HEADER_V2_LBA + 1;
+    hdr.headerSectors = headerSectors;
+    hdr.tableCrc = crc32(table, images.size() * sizeof(ImageInfoV2));
+    hdr.headerCrc = crc32(&hdr, sizeof(hdr));
+    if (gpt)
+    {
+        vector<char> entries;
+        GptHeader &gptHeader = *(GptHeader *)&header[SECTOR_SIZE];
+        fillGpt(entries, gptHeader, false);
+        memcpy(&header[2 * SECTOR_SIZE], entries.data(), entries.size());
+    }
+}
+template <class Io>
+void ImageKeeper<Io>::fillGpt(vector<char> &entries, GptHeader &gptHeader, bool backup) const
+{
+    static const uint8_t linuxDataGuid[16] = {0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47,
+                                              0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4};
+    // Same seed for both tables, so primary and backup GUIDs match
+    mt19937_64 guids(guidSeed);
+    auto fillGuid = [&guids](uint8_t *guid)
+    {
+        uint64_t random[2] = {guids(), guids()};
+        memcpy(guid, random, 16);
+        guid[7] = (guid[7] & 0x0F) | 0x40; // version 4
+        guid[8] = (guid[8] & 0x3F) | 0x80; // variant 1
+    };
+    uint64_t lastLBA = (size >> BYTES_TO_SECTORS) - 1;
+
+    entries.assign(GPT_ENTRIES_SECTORS << BYTES_TO_SECTORS, 0);
+    GptEntry *entry = (GptEntry *)entries.data();
+    for (unsigned i = 0; i < images.size(); i++)
+    {
+        memcpy(entry[i].typeGuid, linuxDataGuid, sizeof(linuxDataGuid));
+        fillGuid(entry[i].uniqueGuid);
+        entry[i].firstLBA = images[i].firstSectorLBA;
+        entry[i].lastLBA = images[i].firstSectorLBA + images[i].sectorsCountLBA - 1;
+        for (size_t k = 0; k < images[i].imageName.size() && k < sizeof(entry[i].name) / sizeof(entry[i].name[0]) - 1; k++)
+        {
+            entry[i].name[k] = (uint8_t)images[i].imageName[k];
+        }
+    }
+
+    memset(&gptHeader, 0, sizeof(gptHeader));
+    memcpy(gptHeader.signature, "EFI PART", sizeof(gptHeader.signature));
+    gptHeader.revision = 0x00010000;
+    gptHeader.headerSize = 92;
+    gptHeader.currentLBA = backup ? lastLBA : 1;
+    gptHeader.backupLBA = backup ? 1 : lastLBA;
+    gptHeader.firstUsableLBA = headerSectors;
+    gptHeader.lastUsableLBA = lastLBA - GPT_ENTRIES_SECTORS - 1;
+    fillGuid(gptHeader.diskGuid);
+    gptHeader.entriesLBA = backup ? lastLBA - GPT_ENTRIES_SECTORS : 2;
+    gptHeader.entriesCount = GPT_ENTRIES_COUNT;
+    gptHeader.entrySize = sizeof(GptEntry);
+    gptHeader.entriesCrc = crc32(entries.data(), entries.size());
+    gptHeader.headerCrc = crc32(&gptHeader, gptHeader.headerSize);
+}
+template <class Io>
+err::status ImageKeeper<Io>::saveBoot(unsigned bootNumber, bool mbrOnly)
+{
+    if (bootNumber < 1 || bootNumber > images.size())
+    {
+        errorLog << "Error: image number is greater then count of images on device " << name << endl;
+        return (statusError = err::imageNum);
+    }
+    bootNumber--;
+    seek(images[bootNumber].firstSectorLBA << BYTES_TO_SECTORS, ios::beg);
+    if (statusError)
+    {
+        return statusError;
+    }
+    if (preview)
+    {
+        return statusError;
+    }
+    read((char *)&mbr, sizeof(mbr));
+    if (statusError)
+    {
+        return statusError;
+    }
+    if (mbr.mbr_signature != MAGIC_MBR)
+    {
+        errorLog << "Error: no magic in mbr of image " << bootNumber+1 << ' ' << images[bootNumber].imageName << endl;
+        return (statusError = err::mbrMagic);
+    }
+    if (images[bootNumber].firstSectorLBA + mbr.partition[1].firstSectorLBA + mbr.partition[1].sectorsCountLBA > MAX_MBR_LBA)
+    {
+        errorLog << "Error: image " << bootNumber+1 << ' ' << images[bootNumber].imageName << " lies beyond 2 TiB and cannot be booted via MBR" << endl;
+        return (statusError = err::lbaRange);
+    }
+
+    mbr.partition[0].firstSectorLBA += (uint32_t)images[bootNumber].firstSectorLBA;
+    mbr.partition[1].firstSectorLBA += (uint32_t)images[bootNumber].firstSectorLBA;
+    mbr.partition[2].firstSectorLBA = (uint32_t)headerSectors;
+    mbr.partition[2].sectorsCountLBA = (uint32_t)(min(chainEnd(), MAX_MBR_LBA) - headerSectors);
+    mbr.partition[2].partition_type = 0x1F;
+    if (gpt)
+    {
+        // Hybrid MBR: protective entry marks the header region, so host uses GPT.
+        // Kernel on TV-box uses GPT too and finds no root partition, so drive is host only
+        memset(&mbr.partition[3], 0, sizeof(mbr.partition[3]));
+        mbr.partition[3].partition_type = 0xEE;
+        mbr.partition[3].firstSectorLBA = 1;
+        mbr.partition[3].sectorsCountLBA = (uint32_t)(headerSectors - 1);
+    }
+
+    seek(0, ios::beg);
+    if (statusError)
+    {
+        errorLog << "Error seeking dst device " << name << endl;
+        return (statusError = err::dstSeek);
+    }
+    // Image table and xbr are unchanged on switch, so only the MBR sector is dirty
+    if (mbrOnly)
+    {
+        write((char *)&mbr, sizeof(mbr));
+    }
+    else
+    {
+        vector<char> header(getHeaderSize(), 0);
+        if (version == 1)
+        {
+            fillHeaderV1(header);
+        }
+        else
+        {
+            fillHeaderV2(header);
+        }
+        write(header.data(), header.size());
+        uint64_t dataEnd = chainEnd() << BYTES_TO_SECTORS; // end of images and manifest
+        if (!statusError)
+        {
+            vector<char> manifest;
+            fillManifest(manifest);
+            seek(dataEnd, ios::beg);
+            if (!statusError)
+            {
+                write(manifest.data(), manifest.size());
+                dataEnd += manifest.size();
+            }
+        }
+        if (!statusError && gpt)
+        {
+            vector<char> entries;
+            GptHeader gptHeader;
+            fillGpt(entries, gptHeader, true);
+            seek(-streamoff(entries.size() + sizeof(gptHeader)), ios::end);
+            if (!statusError)
+            {
+                write(entries.data(), entries.size());
+                write((char *)&gptHeader, sizeof(gptHeader));
+            }
+        }
+        else if (!statusError)
+        {
+            // Clear backup GPT left by earlier build with GPT, or disk tools
+            // offer to restore a table pointing at old slots
+            uint64_t backupStart = size - ((GPT_ENTRIES_SECTORS + 1) << BYTES_TO_SECTORS);
+            uint64_t clearStart = max(dataEnd, backupStart);
+            if (clearStart < size)
+            {
+                vector<char> zeros(size - clearStart, 0);
+                seek(clearStart, ios::beg);
+                if (!statusError)
+                {
+                    write(zeros.data(), zeros.size());
+                }
+            }
+        }
+    }
+    if (!statusError)
+    {
+        sync();
+    }
+    return statusError;
+}
+template <class Io>
+unsigned ImageKeeper<Io>::findImage(const char *imageName) const
+{
+    vector<char> shortName(nameSize());
+    fillImageName(shortName.data(), imageName, shortName.size());
+    auto found = nameIndex.find(shortName.data());
+    return found == nameIndex.end() ? 0 : found->second;
+}
+template <class Io>
+err::status ImageKeeper<Io>::readHeaderV1(const vector<char> &header)
+{
+    const DiskHeader &hdr = *(const DiskHeader *)header.data();
+    version = 1;
+    headerSectors = HEADER_SIZE >> BYTES_TO_SECTORS;
+    for (size_t i = 0; i < MAX_IMAGECOUNT; i++)
+    {
+        if (hdr.images[i].firstSectorLBA == 0) // looks like this image is zeroed ie empty
+            break;
+        ImageSlot slot;
+        slot.firstSectorLBA = hdr.images[i].firstSectorLBA;
+        slot.sectorsCountLBA = hdr.images[i].sectorsCountLBA;
+        slot.part0firstSectorLBA = hdr.images[i].part0firstSectorLBA;
+        slot.sourceBytes = 0;
+        slot.imageName.assign(hdr.images[i].imageName, strnlen(hdr.images[i].imageName, sizeof(hdr.images[i].imageName)));
+        images.push_back(slot);
+    }
+    return statusError;
+}
+template <class Io>
+err::status ImageKeeper<Io>::readHeaderV2(const vector<char> &header)
+{
+    HeaderV2 hdr = *(const HeaderV2 *)&header[HEADER_V2_LBA << BYTES_TO_SECTORS];
+    uint32_t headerCrc = hdr.headerCrc;
+    hdr.headerCrc = 0;
+    if (hdr.version != HEADER_VERSION || crc32(&hdr, sizeof(hdr)) != headerCrc ||
+        hdr.imagesCount > MAX_IMAGECOUNT_V2 || hdr.tableLBA <= HEADER_V2_LBA)
+    {
+        errorLog << "Error: unsupported or corrupted v2 header on device " << name << endl;
+        return (statusError = err::badHeader);
+    }
+    version = hdr.version;
+    gpt = (hdr.flags & FLAG_GPT) != 0;
+    headerSectors = hdr.headerSectors;
+
+    vector<ImageInfoV2> table(hdr.imagesCount);
+    seek(hdr.tableLBA << BYTES_TO_SECTORS, ios::beg);
+    if (statusError)
+    {
+        return statusError;
+    }
+    read((char *)table.data(), table.size() * sizeof(ImageInfoV2));
+    if (statusError)
+    {
+        return statusError;
+    }
+    if (crc32(table.data(), table.size() * sizeof(ImageInfoV2)) != hdr.tableCrc)
+    {
+        errorLog << "Error: image table crc mismatch on device " << name << endl;
+        return (statusError = err::badHeader);
+    }
+    for (auto &info : table)
+    {
+        ImageSlot slot;
+        slot.firstSectorLBA = info.firstSectorLBA;
+        slot.sectorsCountLBA = info.sectorsCountLBA;
+        slot.part0firstSectorLBA = info.part0firstSectorLBA;
+        slot.sourceBytes = 0;
+        slot.imageName.assign(info.imageName, strnlen(info.imageName, sizeof(info.imageName)));
+        images.push_back(slot);
+    }
+    return statusError;
+}
+template <class Io>
+err::status ImageKeeper<Io>::readBoot()
+{
+    seek(0, ios::beg);
+    if (statusError)
+    {
+        return statusError;
+    }
+    vector<char> header(HEADER_SIZE);
+    read(header.data(), header.size());
+    if (statusError)
+    {
+        return statusError;
+    }
+    mbr = *(MasterBootRecord *)header.data();
+    images.clear();
+
+    bool isV1 = true;
+    const char *xbr = &header[sizeof(MasterBootRecord)];
+    for (size_t i = 0; i < sizeof(ExtBootRecord); i++)
+    {
+        if (xbr[i] != MAGIC_XBR)
+        {
+            isV1 = false;
+            break;
+        }
+    }
+    if (isV1)
+    {
+        readHeaderV1(header);
+    }
+    else if (memcmp(&header[HEADER_V2_LBA << BYTES_TO_SECTORS], MAGIC_V2, sizeof(MAGIC_V2)) == 0)
+    {
+        readHeaderV2(header);
+    }
+    else
+    {
+        errorLog << "Error: ExtBootRecord xbr contains no expected magic." << endl;
+        return (statusError = err::noMagic);
+    }
+    if (statusError)
+    {
+        return statusError;
+    }
+
+    if (images.empty())
+    {
+        errorLog << "Error: No images found on device " << name << endl;
+        statusError = err::emptyBoot;
+        return statusError;
+    }
+    indexNames();
+
+    return statusError;
+}
+
+template <class Io>
+void ImageKeeper<Io>::fillManifest(vector<char> &manifest) const
+{
+    uint64_t entriesSectors = (images.size() * sizeof(ManifestEntry) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint64_t sectors = 1 + entriesSectors;
+    for (auto &slot : images)
+    {
+        sectors += (slot.blockHashes.size() * sizeof(uint64_t) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    }
+    manifest.assign(sectors << BYTES_TO_SECTORS, 0);
+
+    ManifestHeader &hdr = *(ManifestHeader *)manifest.data();
+    ManifestEntry *entries = (ManifestEntry *)&manifest[SECTOR_SIZE];
+    uint64_t hashesSector = 1 + entriesSectors; // relative to manifest start
+    for (unsigned i = 0; i < images.size(); i++)
+    {
+        const vector<uint64_t> &hashes = images[i].blockHashes;
+        entries[i].sourceBytes = images[i].sourceBytes;
+        entries[i].blocksCount = hashes.size();
+        entries[i].hashesLBA = chainEnd() + hashesSector;
+        entries[i].digest = xxh64(hashes.data(), hashes.size() * sizeof(uint64_t));
+        memcpy(&manifest[hashesSector << BYTES_TO_SECTORS], hashes.data(), hashes.size() * sizeof(uint64_t));
+        hashesSector += (hashes.size() * sizeof(uint64_t) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    }
+    memcpy(hdr.magic, MAGIC_MANIFEST, sizeof(hdr.magic));
+    hdr.blockSize = BUFFER_SIZE;
+    hdr.imagesCount = images.size();
+    hdr.entriesCrc = crc32(entries, images.size() * sizeof(ManifestEntry));
+    hdr.headerCrc = crc32(&hdr, sizeof(hdr));
+}
+template <class Io>
+err::status ImageKeeper<Io>::readManifest()
+{
+    uint64_t manifestLBA = chainEnd();
+    if ((manifestLBA + 1) << BYTES_TO_SECTORS > size)
+    {
+        errorLog << "Error: no block hash manifest on device " << name << endl;
+        return (statusError = err::noManifest);
+    }
+    ManifestHeader hdr;
+    seek(manifestLBA << BYTES_TO_SECTORS, ios::beg);
+    if (statusError)
+    {
+        return statusError;
+    }
+    read((char *)&hdr, sizeof(hdr));
+    if (statusError)
+    {
+        return statusError;
+    }
+    if (memcmp(hdr.magic, MAGIC_MANIFEST, sizeof(hdr.magic)) != 0)
+    {
+        errorLog << "Error: no block hash manifest on device " << name << endl;
+        return (statusError = err::noManifest);
+    }
+    uint32_t headerCrc = hdr.headerCrc;
+    hdr.headerCrc = 0;
+    if (crc32(&hdr, sizeof(hdr)) != headerCrc || hdr.blockSize != BUFFER_SIZE || hdr.imagesCount != images.size())
+    {
+        errorLog << "Error: block hash manifest on device " << name << " is corrupted or stale" << endl;
+        return (statusError = err::noManifest);
+    }
+
+    uint64_t entriesSectors = (images.size() * sizeof(ManifestEntry) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    vector<ManifestEntry> entries(entriesSectors * SECTOR_SIZE / sizeof(ManifestEntry));
+    read((char *)entries.data(), entriesSectors << BYTES_TO_SECTORS);
+    if (statusError)
+    {
+        return statusError;
+    }
+    if (crc32(entries.data(), images.size() * sizeof(ManifestEntry)) != hdr.entriesCrc)
+    {
+        errorLog << "Error: block hash manifest on device " << name << " is corrupted" << endl;
+        return (statusError = err::noManifest);
+    }
+    for (unsigned i = 0; i < images.size(); i++)
+    {
+        ImageSlot &slot = images[i];
+        uint64_t hashesSectors = (entries[i].blocksCount * sizeof(uint64_t) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (entries[i].blocksCount > (slot.sectorsCountLBA << BYTES_TO_SECTORS) / BUFFER_SIZE ||
+            entries[i].hashesLBA <= manifestLBA || (entries[i].hashesLBA + hashesSectors) << BYTES_TO_SECTORS > size)
+        {
+            errorLog << "Error: block hash manifest on device " << name << " is corrupted" << endl;
+            return (statusError = err::noManifest);
+        }
+        slot.blockHashes.resize(hashesSectors * SECTOR_SIZE / sizeof(uint64_t));
+        seek(entries[i].hashesLBA << BYTES_TO_SECTORS, ios::beg);
+        if (statusError)
+        {
+            return statusError;
+        }
+        read((char *)slot.blockHashes.data(), hashesSectors << BYTES_TO_SECTORS);
+        if (statusError)
+        {
+            return statusError;
+        }
+        slot.blockHashes.resize(entries[i].blocksCount);
+        if (xxh64(slot.blockHashes.data(), slot.blockHashes.size() * sizeof(uint64_t)) != entries[i].digest)
+        {
+            errorLog << "Error: block hashes of image " << i+1 << ' ' << slot.imageName << " are corrupted" << endl;
+            return (statusError = err::noManifest);
+        }
+        slot.sourceBytes = entries[i].sourceBytes;
+    }
     return statusError;
 }
-err::status ImageKeeper::saveBoot(unsigned bootNumber)
+// Hashes source image only and compares it against manifest written at build,
+// image on device itself is not read, scrub does that
+template <class Io>
+err::status ImageKeeper<Io>::compare(typename Io::Source &image, unsigned bootNumber)
 {
-    memset(&hdr.xbr, MAGIC_XBR, sizeof(hdr.xbr));
-    if (bootNumber > imagesCount)
+    if (bootNumber < 1 || bootNumber > images.size())
     {
-        cerr << "Error: image number is greater then count of images on device " << name << endl;
+        errorLog << "Error: image number is greater then count of images on device " << name << endl;
         return (statusError = err::imageNum);
     }
-    bootNumber--;
-    seek(hdr.images[bootNumber].firstSectorLBA << BYTES_TO_SECTORS, ios::beg);
-    if (statusError)
-    {
-        return statusError;
-    }
-    if (preview)
-    {
-        return statusError;
-    }
-    read((char *)&hdr.mbr, sizeof(hdr.mbr));
-    if (statusError)
+    if (readManifest())
     {
         return statusError;
     }
-    if (hdr.mbr.mbr_signature != MAGIC_MBR)
-    {
-        cerr << "Error: no magic in mbr of image " << bootNumber+1 << ' ' << hdr.images[bootNumber].imageName << endl;
-        return (statusError = err::mbrMagic);
-    }
+    const ImageSlot &slot = images[bootNumber - 1];
+    AlignedBuffer buffer = allocAligned(BUFFER_SIZE);
+    uint64_t imageSizeBytes = slot.sectorsCountLBA << BYTES_TO_SECTORS;
+    uint64_t sourceBytes = 0;
+    uint64_t blocks = 0;
+    uint64_t differ = 0;
 
-    hdr.mbr.partition[0].firstSectorLBA += hdr.images[bootNumber].firstSectorLBA;
-    hdr.mbr.partition[1].firstSectorLBA += hdr.images[bootNumber].firstSectorLBA;
-    hdr.mbr.partition[2].firstSectorLBA = (HEADER_SIZE >> BYTES_TO_SECTORS);
-    hdr.mbr.partition[2].sectorsCountLBA = hdr.images[imagesCount-1].sectorsCountLBA + hdr.images[imagesCount-1].firstSectorLBA - (HEADER_SIZE >> BYTES_TO_SECTORS);
-    hdr.mbr.partition[2].partition_type = 0x1F;
-
-    seek(0, ios::beg);
-    if (statusError)
+    streamsize countRead;
+    while ((countRead = image.read(buffer.get(), BUFFER_SIZE)) > 0)
     {
-        cerr << "Error seeking dst device " << name << endl;
-        return (statusError = err::dstSeek);
+        sourceBytes += countRead;
+        if (countRead < BUFFER_SIZE)
+        {
+            memset(buffer.get() + countRead, 0, BUFFER_SIZE - countRead);
+        }
+        bool blockDiffers = blocks >= slot.blockHashes.size();
+        if (blocks == 0)
+        {
+            MasterBootRecord &imageMbr = *(MasterBootRecord *)buffer.get();
+            if (mbrFits(imageMbr, imageSizeBytes))
+            {
+                fitMbr(imageMbr, imageSizeBytes, slot.imageName, bootNumber);
+            }
+            else
+            {
+                blockDiffers = true; // source outgrew its slot, just a mismatch here
+            }
+        }
+        if (blockDiffers || slot.blockHashes[blocks] != xxh64(buffer.get(), BUFFER_SIZE))
+        {
+            differ++;
+        }
+        blocks++;
+        if (countRead < BUFFER_SIZE)
+        {
+            break;
+        }
     }
-    write((char *)&hdr, sizeof(hdr));
-    if (!statusError)
+    if (countRead < 0)
     {
-        device.flush();
+        errorLog << "Error reading src image" << endl;
+        return (statusError = err::srcRead);
     }
-    if (device.fail())
+
+    if (sourceBytes != slot.sourceBytes || differ)
     {
-        cerr << "Error flushing dst device " << name << endl;
-        return (statusError = err::dstFlush);
+        cout << "Source of image " << bootNumber << ' ' << slot.imageName << " differs from manifest written at build: " << differ << " of " << blocks
+             << " blocks, source " << sourceBytes << " bytes, written " << slot.sourceBytes << " bytes." << endl;
+        return (statusError = err::mismatch);
     }
+    cout << "Source of image " << bootNumber << ' ' << slot.imageName << " matches manifest written at build, " << blocks << " blocks." << endl
+         << "Device itself is not read, run v to verify image on device." << endl;
     return statusError;
 }
-err::status ImageKeeper::readBoot()
+// Re-reads sampled blocks of each image, 0 samples means all blocks
+template <class Io>
+err::status ImageKeeper<Io>::scrub(unsigned samples)
 {
-    seek(0, ios::beg);
-    if (statusError)
+    if (readManifest())
     {
         return statusError;
     }
-    read((char *)&hdr, sizeof(hdr));
-    if (statusError)
+    AlignedBuffer buffer = allocAligned(BUFFER_SIZE);
+    mt19937_64 random((random_device())());
+    bool failed = false;
+
+    for (unsigned i = 0; i < images.size(); i++)
     {
-        return statusError;
-    }
-    
-    for (size_t i = 0; i < sizeof(hdr.xbr); i++)
-        if (((char *)&hdr.xbr)[i] != MAGIC_XBR)
+        const ImageSlot &slot = images[i];
+        vector<uint64_t> blocks(slot.blockHashes.size());
+        for (uint64_t k = 0; k < blocks.size(); k++)
+        {
+            blocks[k] = k;
+        }
+        if (samples && samples < blocks.size())
         {
-            cerr << "Error: ExtBootRecord xbr contains no expected magic." << endl;
-            return (statusError = err::noMagic);
+            for (unsigned k = 0; k < samples; k++) // partial Fisher-Yates
+            {
+                swap(blocks[k], blocks[k + random() % (blocks.size() - k)]);
+            }
+            blocks.resize(samples);
+            sort(blocks.begin(), blocks.end());
         }
 
-    for (imagesCount = 0; imagesCount < MAX_IMAGECOUNT; imagesCount++)
-    {
-        if (hdr.images[imagesCount].firstSectorLBA == 0) // looks like this image is zeroed ie empty
-            break;
+        uint64_t differ = 0;
+        for (auto block : blocks)
+        {
+            seek((slot.firstSectorLBA << BYTES_TO_SECTORS) + block * BUFFER_SIZE, ios::beg);
+            if (statusError)
+            {
+                return statusError;
+            }
+            read(buffer.get(), BUFFER_SIZE);
+            if (statusError)
+            {
+                return statusError;
+            }
+            if (xxh64(buffer.get(), BUFFER_SIZE) != slot.blockHashes[block])
+            {
+                errorLog << "Error: image " << i+1 << ' ' << slot.imageName << " block " << block << " differs from manifest" << endl;
+                differ++;
+            }
+        }
+        cout << (differ ? "FAIL " : "OK   ") << i+1 << ": " << slot.imageName << ", "
+             << differ << " of " << blocks.size() << " checked blocks differ" << endl;
+        failed = failed || differ;
     }
-
-    if (imagesCount <= 0)
+    if (failed)
     {
-        cerr << "Error: No images found on device " << name << endl;
-        statusError = err::emptyBoot;
-        return statusError;
+        cout << "Note: manifest records images as built. Blocks changed by noexpand.sh or by booting an image differ as well." << endl;
+        statusError = err::mismatch;
     }
-
     return statusError;
 }
-
+template <class Io>
 class ImageReader
 {
 public:
-    ImageReader(int size_, const char *fileName);
-    istream &getStream()
+    ImageReader(unsigned size_, const char *fileName);
+    err::status open();
+    void close()
+    {
+        image.close();
+    }
+    typename Io::Source &getSource()
     {
         return image;
     }
@@ -441,7 +1715,7 @@ public:
     {
         return name;
     }
-    int getSizeGiB() const
+    unsigned getSizeGiB() const
     {
         return size;
     }
@@ -451,32 +1725,34 @@ public:
     }
 private:
     err::status statusError;
-    int size;
+    unsigned size;
     string name;
-    ifstream image;
+    typename Io::Source image;
 };
-ImageReader::ImageReader(int size_, const char *fileName):
+template <class Io>
+ImageReader<Io>::ImageReader(unsigned size_, const char *fileName):
     statusError(err::ok),
     size(size_),
-    name(fileName),
-    image(fileName)
+    name(fileName)
+{
+}
+template <class Io>
+err::status ImageReader<Io>::open()
 {
-    if (image.eof() || image.bad() || !image.is_open())
+    if (!image.open(name.c_str()))
     {
         cerr << "Error opening src image " << name << endl;
         statusError = err::srcOpen;
     }
-    if (statusError)
-    {
-        image.close();
-    }
+    return statusError;
 }
 
+template <class Io>
 class ImageList
 {
 public:
     ImageList(const char *listFileName);
-    list<unique_ptr<ImageReader>> &items()
+    list<unique_ptr<ImageReader<Io>>> &items()
     {
         return images;
     }
@@ -489,10 +1765,11 @@ public:
         return statusError;
     }
 private:
-    list<unique_ptr<ImageReader>> images;
+    list<unique_ptr<ImageReader<Io>>> images;
     err::status statusError;
 };
-ImageList::ImageList(const char *listFileName):
+template <class Io>
+ImageList<Io>::ImageList(const char *listFileName):
     statusError(err::ok)
 {
     ifstream listFile(listFileName, ios::in | ios::binary);
@@ -555,12 +1832,14 @@ ImageList::ImageList(const char *listFileName):
 #if 0 // #ifndef NDEBUG
             cout << "Info:" << lineNumber << ":" << size << " <<" << name << ">>" << endl;
 #endif
-            unique_ptr<ImageReader> reader(new ImageReader(size, name));
-            if ((statusError = reader->error()))
+            // Only check source opens: build opens one source at a time,
+            // so count of images is not limited by open files limit
+            unique_ptr<ImageReader<Io>> reader(new ImageReader<Io>(size, name));
+            if ((statusError = reader->open()))
             {
-                // delete reader;
                 break;
             }
+            reader->close();
             images.push_back(move(reader));
         }
         if (images.size() == 0)
@@ -568,9 +1847,9 @@ ImageList::ImageList(const char *listFileName):
             cerr << "Error: no image files defined in " << listFileName << endl;
             statusError = err::emptyList;
         }
-        else if (images.size() > MAX_IMAGECOUNT)
+        else if (images.size() > MAX_IMAGECOUNT_V2)
         {
-            cerr << "Error: image count is " << images.size() << " in " << listFileName << ". Limit is " << MAX_IMAGECOUNT << endl;
+            cerr << "Error: image count is " << images.size() << " in " << listFileName << ". Limit is " << MAX_IMAGECOUNT_V2 << endl;
             statusError = err::imageCount;
         }
     }
@@ -581,11 +1860,12 @@ ImageList::ImageList(const char *listFileName):
     }
 }
 
-err::status performBuild(const char *dstDevice, const char *listFileName, bool preview, unsigned bootNumber)
+template <class Io>
+err::status performBuild(const char *dstDevice, const char *listFileName, bool preview, bool gpt, unsigned bootNumber)
 {
     err::status statusError = err::ok;
 
-    ImageList imageList(listFileName);
+    ImageList<Io> imageList(listFileName);
     if (imageList.error())
     {
         return imageList.error();
@@ -597,21 +1877,27 @@ err::status performBuild(const char *dstDevice, const char *listFileName, bool p
         return err::imageNum;
     }
 
-    ImageKeeper w(dstDevice, preview);
+    ImageKeeper<Io> w(dstDevice, preview);
     if (w.error())
     {
         return w.error();
     }
 
     { // Check there is enough space on dst drive for all extended images and MBS
-        int requiredGiB = 0;
+        uint64_t requiredGiB = 0;
         for (auto &reader : imageList.items())
         {
             requiredGiB += reader->getSizeGiB();
         }
-        if (streampos(requiredGiB) > ((w.getSize() - streampos(HEADER_SIZE)) >> BYTES_TO_GIB))
+        if (w.setLayout(imageList.items().size(), requiredGiB, gpt))
+        {
+            return w.error();
+        }
+        uint64_t deviceSize = w.getSize();
+        uint64_t availableGiB = deviceSize > w.getReservedSize() ? (deviceSize - w.getReservedSize()) >> BYTES_TO_GIB : 0;
+        if (requiredGiB > availableGiB)
         {
-            cerr << "Error: not enough space. Dst available:" << ((w.getSize() - streampos(HEADER_SIZE)) >> BYTES_TO_GIB) << "GiB. Required:" << requiredGiB << "GiB." << endl;
+            cerr << "Error: not enough space. Dst available:" << availableGiB << "GiB. Required:" << requiredGiB << "GiB." << endl;
             imageList.clear();
             return err::space;
         }
@@ -619,7 +1905,11 @@ err::status performBuild(const char *dstDevice, const char *listFileName, bool p
 
     for (auto &reader: imageList.items())
     {
-        statusError = w.write(reader->getStream(), reader->getName(), reader->getSizeGiB());
+        statusError = reader->open();
+        if (statusError)
+            break;
+        statusError = w.write(reader->getSource(), reader->getName(), reader->getSizeGiB());
+        reader->close();
         if (statusError)
             break;
     }
@@ -627,12 +1917,17 @@ err::status performBuild(const char *dstDevice, const char *listFileName, bool p
     {
         statusError = w.saveBoot(bootNumber);
     }
+    if (!statusError && gpt)
+    {
+        cout << "Warning: drive has GPT for host access only, it does not boot on TV-box." << endl;
+    }
     return statusError;
 }
 
+template <class Io>
 err::status performList(const char *device)
 {
-    ImageKeeper w(device, true); // Simulate preview mode to avoid disk write
+    ImageKeeper<Io> w(device, true); // Simulate preview mode to avoid disk write
 
     if (w.error() ||
         w.readBoot())
@@ -643,9 +1938,52 @@ err::status performList(const char *device)
     return w.print();
 }
 
+template <class Io>
+err::status performCompare(const char *device, const char *imageFileName, unsigned bootNumber)
+{
+    ImageKeeper<Io> w(device, true); // Open read only, only manifest is read from device
+
+    if (w.error() ||
+        w.readBoot())
+    {
+        return w.error();
+    }
+    if (bootNumber == 0)
+    {
+        bootNumber = w.findImage(imageFileName);
+        if (bootNumber == 0)
+        {
+            cerr << "Error: image " << imageFileName << " not found on device " << device << endl;
+            return err::noImage;
+        }
+    }
+
+    ImageReader<Io> reader(0, imageFileName);
+    if (reader.open())
+    {
+        return reader.error();
+    }
+    return w.compare(reader.getSource(), bootNumber);
+}
+
+template <class Io>
+err::status performScrub(const char *device, unsigned samples)
+{
+    ImageKeeper<Io> w(device, true);
+
+    if (w.error() ||
+        w.readBoot())
+    {
+        return w.error();
+    }
+
+    return w.scrub(samples);
+}
+
+template <class Io>
 err::status performSwitch(const char *device, unsigned bootNumber)
 {
-    ImageKeeper w(device, false);
+    ImageKeeper<Io> w(device, false);
 
     if (w.error() ||
         w.readBoot())
@@ -653,20 +1991,178 @@ err::status performSwitch(const char *device, unsigned bootNumber)
         return w.error();
     }
 
-    return w.saveBoot(bootNumber);
+    return w.saveBoot(bootNumber, true);
+}
+
+// Build, list, switch through all images and scrub all blocks in one process,
+// so --io=memory device keeps its content between steps. Destructive and leaves
+// last image active, so runs only on RAM disk.
+template <class Io>
+err::status performTest(const char *device, const char *listFileName)
+{
+    if (!is_same<Io, MemoryIo>::value)
+    {
+        cerr << "Error: test run works only on RAM disk: amboot --io=memory t mem:<sizeGiB> " << listFileName << endl;
+        return err::cmdLine;
+    }
+    auto started = chrono::steady_clock::now();
+    auto step = [&started](const char *stepName)
+    {
+        auto now = chrono::steady_clock::now();
+        cout << "Info: " << stepName << " took " << chrono::duration_cast<chrono::milliseconds>(now - started).count() << " ms" << endl;
+        started = now;
+    };
+
+    err::status statusError = performBuild<Io>(device, listFileName, false, false, 1);
+    if (statusError)
+    {
+        return statusError;
+    }
+    step("build");
+    if ((statusError = performList<Io>(device)))
+    {
+        return statusError;
+    }
+    step("list");
+    size_t imagesCount;
+    {
+        ImageKeeper<Io> w(device, true);
+        if (w.error() ||
+            w.readBoot())
+        {
+            return w.error();
+        }
+        imagesCount = w.getImagesCount();
+    }
+    for (unsigned bootNumber = 1; bootNumber <= imagesCount; bootNumber++)
+    {
+        if ((statusError = performSwitch<Io>(device, bootNumber)))
+        {
+            return statusError;
+        }
+    }
+    step("switch");
+    if ((statusError = performScrub<Io>(device, 0)))
+    {
+        return statusError;
+    }
+    step("scrub");
+    return statusError;
+}
+
+struct SwitchResult
+{
+    const char *device;
+    unsigned bootNumber;
+    string imageName;
+    string errorText; // messages of this device only, threads do not share cerr
+    err::status statusError;
+};
+
+template <class Io>
+void switchOne(SwitchResult &result, unsigned bootNumber, const char *imageName)
+{
+    ostringstream errorLog;
+    ImageKeeper<Io> w(result.device, false, errorLog);
+
+    if (w.error() ||
+        w.readBoot())
+    {
+        result.statusError = w.error();
+    }
+    else if (imageName && (bootNumber = w.findImage(imageName)) == 0)
+    {
+        errorLog << "Error: image " << imageName << " not found on device " << result.device << endl;
+        result.statusError = err::noImage;
+    }
+    else
+    {
+        result.statusError = w.saveBoot(bootNumber, true);
+    }
+    result.errorText = errorLog.str();
+    if (!result.statusError)
+    {
+        result.bootNumber = bootNumber;
+        result.imageName = w.getImageName(bootNumber);
+    }
+}
+
+template <class Io>
+err::status performBatchSwitch(char **devices, int devicesCount, unsigned bootNumber, const char *imageName)
+{
+    vector<SwitchResult> results;
+    vector<thread> workers;
+    unordered_set<string> seen; // two threads on one device would race on its MBR
+
+    for (int i = 0; i < devicesCount; i++)
+    {
+        char *resolved = realpath(devices[i], NULL); // catches symlinks like /dev/disk/by-id
+        string key = resolved ? resolved : devices[i];
+        free(resolved);
+        if (!seen.insert(key).second)
+        {
+            cerr << "Info: skipping repeated device " << devices[i] << endl;
+            continue;
+        }
+        SwitchResult result;
+        result.device = devices[i];
+        result.bootNumber = 0;
+        result.statusError = err::ok;
+        results.push_back(result);
+    }
+    for (auto &result : results)
+    {
+        workers.push_back(thread(switchOne<Io>, ref(result), bootNumber, imageName));
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    err::status statusError = err::ok;
+    for (auto &result : results)
+    {
+        if (result.statusError)
+        {
+            cout << "FAIL " << result.device << ": error " << result.statusError << endl << result.errorText;
+            if (!statusError)
+            {
+                statusError = result.statusError;
+            }
+        }
+        else
+        {
+            cout << "OK   " << result.device << ": " << result.bootNumber << ' ' << result.imageName << endl;
+        }
+    }
+    return statusError;
 }
 
 void printUsage()
 {
     cerr << "Usage is:\n"
             "amboot b /dev/sd? /full/path/to/imagelistfile [bootNumber]\n"
-            "\tbuild on specified device and set boot image to bootNumber, 1 to " << MAX_IMAGECOUNT << "\n"
+            "\tbuild on specified device and set boot image to bootNumber, 1 to " << MAX_IMAGECOUNT_V2 << "\n"
             "amboot p /dev/sd? /full/path/to/imagelistfile [bootNumber]\n"
             "\tpreview: simulate b_uild without actually write to device\n"
+            "amboot g /dev/sd? /full/path/to/imagelistfile [bootNumber]\n"
+            "\tbuild with v2 header and hybrid GPT, so host sees each image slot as a partition.\n"
+            "\tHost access only: TV-box kernel also reads GPT and does not find root, such drive does not boot\n"
             "amboot l /dev/sd?\n"
             "\tlist image chain on specified device\n"
             "amboot s /dev/sd? bootNumber\n"
-            "\tset boot image to bootNumber, 1 to " << MAX_IMAGECOUNT << " on specified device /dev/sd? (/dev/sda...)\n"
+            "\tset boot image to bootNumber, 1 to " << MAX_IMAGECOUNT_V2 << " on specified device /dev/sd? (/dev/sda...)\n"
+            "amboot m bootNumber|imageName /dev/sd? [/dev/sd? ...]\n"
+            "\tset boot image by number or image name on many devices at once\n"
+            "amboot c /dev/sd? /full/path/to/image [bootNumber]\n"
+            "\tcompare source image with manifest written at build, reads only source, not image on device\n"
+            "amboot v /dev/sd? [samples]\n"
+            "\tverify (scrub) samples random blocks of each image on device, " << SCRUB_SAMPLES << " by default, 0 for all,\n"
+            "\tagainst manifest written at build: run before noexpand.sh or boot, they change blocks legitimately\n"
+            "amboot --io=memory t mem:<sizeGiB> /full/path/to/imagelistfile\n"
+            "\ttest run on RAM disk: build, list, switch to every image and scrub all blocks, timing each step\n"
+            "Any command may be preceded by --io=fstream|posix|direct|memory to select I/O backend:\n"
+            "\tfstream (default), posix pread/pwrite, posix with O_DIRECT, or RAM disk named mem:<sizeGiB>\n"
          << endl;
 }
 
@@ -681,7 +2177,7 @@ unsigned getBootNumber(const char *num)
 {
     char *endptr;
     unsigned long bootNumber = strtoul(num, &endptr, 10);
-    if (bootNumber < 1 || bootNumber > MAX_IMAGECOUNT || *endptr != '\0')
+    if (bootNumber < 1 || bootNumber > MAX_IMAGECOUNT_V2 || *endptr != '\0')
     {
         printUsage();
         return 0;
@@ -689,16 +2185,31 @@ unsigned getBootNumber(const char *num)
     return (unsigned int)bootNumber;
 }
 
+bool isNumber(const char *str)
+{
+    if (*str == 0)
+    {
+        return false;
+    }
+    for (; *str; str++)
+    {
+        if (*str < '0' || *str > '9')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 // p /dev/sdc /home/vagrant/amboot/list.txt
 // l /dev/sdc
 // s /dev/sdc 1 
-int main(int argc, char **argv)
+// m 1 /dev/sdc /dev/sdd
+// c /dev/sdc /home/vagrant/amboot/Armbian_5.67_Aml-s9xxx_Debian_stretch_default_4.19.7_20181218.img
+// v /dev/sdc 16
+template <class Io>
+err::status runCommand(int argc, char **argv)
 {
-    if (!isLittleEndian())
-    {
-        cerr << "Fatal: compile and run only on little-endian byteorder!" << endl;
-        return err::byteorder;
-    }
     err::status returnStatus = err::ok;
     if (argc <= 1 || argv[1][1] != 0)
     {
@@ -710,6 +2221,7 @@ int main(int argc, char **argv)
     {
     case 'p':
     case 'b':
+    case 'g':
         if (argc == 5)
         {
             bootNumber = getBootNumber(argv[4]);
@@ -723,7 +2235,7 @@ int main(int argc, char **argv)
             printUsage();
             return err::cmdLine;
         }
-        returnStatus = performBuild(argv[2], argv[3], argv[1][0] == 'p' ? true : false, bootNumber);
+        returnStatus = performBuild<Io>(argv[2], argv[3], argv[1][0] == 'p' ? true : false, argv[1][0] == 'g', bootNumber);
         break;
     case 'l':
         if (argc != 3)
@@ -731,7 +2243,7 @@ int main(int argc, char **argv)
             printUsage();
             return err::cmdLine;
         }
-        returnStatus = performList(argv[2]);
+        returnStatus = performList<Io>(argv[2]);
         break;
     case 's':
         if (argc != 4)
@@ -744,7 +2256,67 @@ int main(int argc, char **argv)
         {
             return err::cmdLine;
         }
-        returnStatus = performSwitch(argv[2], bootNumber);
+        returnStatus = performSwitch<Io>(argv[2], bootNumber);
+        break;
+    case 'c':
+        bootNumber = 0; // find image by name
+        if (argc == 5)
+        {
+            bootNumber = getBootNumber(argv[4]);
+            if (bootNumber < 1)
+            {
+                return err::cmdLine;
+            }
+        }
+        else if (argc != 4)
+        {
+            printUsage();
+            return err::cmdLine;
+        }
+        returnStatus = performCompare<Io>(argv[2], argv[3], bootNumber);
+        break;
+    case 'v':
+        if (argc == 4 && isNumber(argv[3]))
+        {
+            returnStatus = performScrub<Io>(argv[2], (unsigned)strtoul(argv[3], NULL, 10));
+        }
+        else if (argc == 3)
+        {
+            returnStatus = performScrub<Io>(argv[2], SCRUB_SAMPLES);
+        }
+        else
+        {
+            printUsage();
+            return err::cmdLine;
+        }
+        break;
+    case 't':
+        if (argc != 4)
+        {
+            printUsage();
+            return err::cmdLine;
+        }
+        returnStatus = performTest<Io>(argv[2], argv[3]);
+        break;
+    case 'm':
+        if (argc < 4)
+        {
+            printUsage();
+            return err::cmdLine;
+        }
+        if (isNumber(argv[2]))
+        {
+            bootNumber = getBootNumber(argv[2]);
+            if (bootNumber < 1)
+            {
+                return err::cmdLine;
+            }
+            returnStatus = performBatchSwitch<Io>(argv + 3, argc - 3, bootNumber, NULL);
+        }
+        else
+        {
+            returnStatus = performBatchSwitch<Io>(argv + 3, argc - 3, 0, argv[2]);
+        }
         break;
     default:
         printUsage();
@@ -753,3 +2325,39 @@ int main(int argc, char **argv)
 
     return returnStatus;
 }
+
+// --io=posix m 1 /dev/sdc /dev/sdd
+// --io=memory t mem:64 /home/vagrant/amboot/list.txt
+int main(int argc, char **argv)
+{
+    if (!isLittleEndian())
+    {
+        cerr << "Fatal: compile and run only on little-endian byteorder!" << endl;
+        return err::byteorder;
+    }
+    const char *ioName = "fstream";
+    if (argc > 1 && strncmp(argv[1], "--io=", 5) == 0)
+    {
+        ioName = argv[1] + 5;
+        argc--;
+        argv++;
+    }
+    if (strcmp(ioName, "fstream") == 0)
+    {
+        return runCommand<FstreamIo>(argc, argv);
+    }
+    if (strcmp(ioName, "posix") == 0)
+    {
+        return runCommand<PosixIo>(argc, argv);
+    }
+    if (strcmp(ioName, "direct") == 0)
+    {
+        return runCommand<DirectIo>(argc, argv);
+    }
+    if (strcmp(ioName, "memory") == 0)
+    {
+        return runCommand<MemoryIo>(argc, argv);
+    }
+    printUsage();
+    return err::cmdLine;
+}